@@ -10,6 +10,8 @@ layout(location=2) out vec4 scalarColor; //[0]: temparature, [1]: density
 uniform float texWidth;
 uniform float texHeight;
 uniform float texDepth;
+uniform vec3 brickOffset; // cell offset of this texture in the domain
+uniform vec3 domainSize;
 
 vec3 mod289(vec3 x)
 {
@@ -107,9 +109,9 @@ float Perlin(vec3 P)
 
 void main(void)
 {
-	vec3 cube = vec3( texWidth, texHeight, texDepth );
+	vec3 cube = domainSize;
 	vec3 frequency = 20.0 / cube;  
-    vec3 pos = vec3( geom_UV.xy * cube.xy, layerID.x );  
+    vec3 pos = vec3( geom_UV.xy * vec2(texWidth, texHeight), layerID.x ) + brickOffset;  
     float noise = abs( Perlin( pos*frequency ) );
 
     
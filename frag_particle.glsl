@@ -0,0 +1,16 @@
+#version 330 core
+in float vtx_Alpha;
+out vec4 FragColor;
+
+uniform float particleAlpha;
+
+void main()
+{
+	// round sprite, soft edge
+	vec2 d = gl_PointCoord*2.0 - 1.0;
+	float r2 = dot(d, d);
+	if( r2 > 1.0 ) discard;
+
+	float a = (1.0-r2)*vtx_Alpha*particleAlpha;
+	FragColor = vec4( vec3(1.0, 0.85, 0.6)*a, a ); // premultiplied, additive
+}
@@ -13,6 +13,8 @@ uniform float ambT;
 uniform float buoyAlpha;
 uniform float buoyBeta;
 uniform vec3 forcepoint;
+uniform vec3 brickOffset; // cell offset of this texture in the domain
+uniform vec3 domainSize;
 
 uniform sampler3D velocity;
 uniform sampler3D scalar;
@@ -64,7 +66,9 @@ vec4 SF_force( in sim_output simCoord, in sampler3D temperatureTex )
 {
    if( all( greaterThan(forcepoint,vec3(0.0003)) ) )
    {
-      vec3 dir = ( simCoord.centerCell - forcepoint );
+      // forcepoint is relative to the whole domain
+      vec3 domainCell = ( simCoord.centerCell*vec3(texWidth, texHeight, texDepth) + brickOffset )/domainSize;
+      vec3 dir = ( domainCell - forcepoint );
       return vec4( normalize(dir)*0.03/length(dir), 0.0);
    }
    // add buoyancy for smoke
@@ -78,7 +82,7 @@ vec4 SF_force( in sim_output simCoord, in sampler3D temperatureTex )
 vec4 SF_advect_scal( in sim_output simCoord, in sampler3D velocityTex, in sampler3D scalarTex )
 {
    vec3 pos = simCoord.cellIndex;
-   vec3 cellVel = texture( velocityTex, simCoord.centerCell ).xyz * vec3(texWidth, texHeight, texDepth) ; // samplePointClamp
+   vec3 cellVel = texture( velocityTex, simCoord.centerCell ).xyz * domainSize ; // samplePointClamp, cells of the whole domain
    vec3 advectCell = SF_cellIndex2TexCoord( pos-currTime*cellVel );
    return texture( scalarTex, advectCell ); // sampling : linear
 }
@@ -86,7 +90,7 @@ vec4 SF_advect_scal( in sim_output simCoord, in sampler3D velocityTex, in sample
 vec4 SF_advect_vel( in sim_output simCoord, in sampler3D velocityTex )
 {
    vec3 pos = simCoord.cellIndex;
-   vec3 cellVel = texture( velocityTex, simCoord.centerCell ).xyz * vec3(texWidth, texHeight, texDepth) ; // samplePointClamp
+   vec3 cellVel = texture( velocityTex, simCoord.centerCell ).xyz * domainSize ; // samplePointClamp, cells of the whole domain
    vec3 advectCell = SF_cellIndex2TexCoord( pos-currTime*cellVel );
    return texture( velocityTex, advectCell ); // sampling : linear
 }
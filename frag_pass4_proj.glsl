@@ -7,6 +7,7 @@ layout(location=0) out vec4 vel_pass4;
 uniform float texWidth;
 uniform float texHeight;
 uniform float texDepth;
+uniform vec3 domainSize;  // out of core, tex* is the brick size
 
 uniform sampler3D velocity;
 uniform sampler3D pressure;
@@ -71,7 +72,7 @@ vec4  SF_project( in sim_output simCoord,
    // project the velocity onto its divergence-free component by subtracting 
    // the gradient of pressure.
    vec3 vOld = texture( velocityTex, simCoord.centerCell ).xyz;
-   vec3 vNew = vOld - gradP/vec3(texWidth,texWidth,texDepth);
+   vec3 vNew = vOld - gradP/vec3(domainSize.x,domainSize.x,domainSize.z);
 
    return vec4( vNew, 0);
 }
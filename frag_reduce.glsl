@@ -0,0 +1,32 @@
+#version 330 core
+
+layout(location=0) out vec4 reduce_out; // x: max, yzw: sum
+
+uniform float srcWidth;
+uniform float srcHeight;
+
+uniform sampler2D partial;
+
+const int BLOCK = 4; // REDUCE_BLOCK
+
+void main(void)
+{
+   ivec2 size = ivec2( srcWidth, srcHeight );
+   ivec2 base = ivec2( gl_FragCoord.xy )*BLOCK;
+
+   vec4 result = vec4( 0.0 );
+   for( int j = 0; j < BLOCK; j++ )
+   {
+      for( int i = 0; i < BLOCK; i++ )
+      {
+         ivec2 texel = base + ivec2(i, j);
+         if( any( greaterThanEqual( texel, size ) ) ) continue;
+
+         vec4 value = texelFetch( partial, texel, 0 );
+         result.x = max( result.x, value.x );
+         result.yzw += value.yzw;
+      }
+   }
+
+   reduce_out = result;
+}
@@ -0,0 +1,51 @@
+#version 330 core
+
+layout(location=0) out vec4 reduce_out; // x: max |velocity|, y: sum density, z: sum (p - pPrev)^2
+
+uniform float texWidth;
+uniform float texHeight;
+uniform float texDepth;
+uniform float slabTiles;        // z slabs per row of the target
+
+uniform sampler3D velocity;
+uniform sampler3D scalar;       // [1]: density
+uniform sampler3D pressure;
+uniform sampler3D pressurePrev; // previous jacobi iterate
+
+const int BLOCK = 4; // REDUCE_BLOCK
+
+void main(void)
+{
+   ivec3 size = ivec3( texWidth, texHeight, texDepth );
+   ivec2 blocks = ( size.xy + BLOCK - 1 )/BLOCK;
+
+   // the target tiles one BLOCK-deep slab per blocks.x x blocks.y tile
+   ivec2 frag = ivec2( gl_FragCoord.xy );
+   ivec2 tile = frag/blocks;
+   int slab = tile.y*int( slabTiles ) + tile.x;
+   ivec3 base = ivec3( ( frag - tile*blocks )*BLOCK, slab*BLOCK );
+
+   float maxVel = 0.0;
+   float density = 0.0;
+   float residual = 0.0;
+
+   // fold a BLOCK x BLOCK x BLOCK block; tiles past the last slab stay empty
+   for( int k = 0; k < BLOCK; k++ )
+   {
+      for( int j = 0; j < BLOCK; j++ )
+      {
+         for( int i = 0; i < BLOCK; i++ )
+         {
+            ivec3 cell = base + ivec3(i, j, k);
+            if( any( greaterThanEqual( cell, size ) ) ) continue;
+
+            maxVel = max( maxVel, length( texelFetch( velocity, cell, 0 ).xyz ) );
+            density += texelFetch( scalar, cell, 0 ).y;
+            float dp = texelFetch( pressure, cell, 0 ).x - texelFetch( pressurePrev, cell, 0 ).x;
+            residual += dp*dp;
+         }
+      }
+   }
+
+   reduce_out = vec4( maxVel, density, residual, 0.0 );
+}
@@ -8,6 +8,7 @@ layout(triangle_strip, max_vertices=200) out;
 	vec3 color;
 } VertexIn[3];*/
 in vec2 vtx_UV[];
+flat in int vtx_Instance[];
 
 /*out VertexData {
 	vec2 texCoord;
@@ -18,15 +19,21 @@ out vec2 layerID;
 
 uniform float texDepth;
 
+const int LAYERS = 50; // GEOM_LAYERS: layers per instance, one instance per 50 layers of texDepth
+
 void main()
 {
 	int j = 0;
-	for( j = 0; j < 50; j++)
+	int base = vtx_Instance[0]*LAYERS;
+	for( j = 0; j < LAYERS; j++)
 	{
+		int layer = base + j;
+		if( float(layer) >= texDepth ) break;
+
 		for(int i = 0; i < gl_in.length(); i++)
 		{
-			gl_Layer = j;
-	 		layerID = vec2(j);
+			gl_Layer = layer;
+	 		layerID = vec2(layer);
 			// copy attributes
 			gl_Position = vec4( gl_in[i].gl_Position.xy, gl_in[i].gl_Position.zw );
 			geom_UV = vec2( vtx_UV[i].xy );
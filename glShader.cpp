@@ -19,10 +19,36 @@
 #include <algorithm>
 #include <cmath>
 #include <chrono>
+#include <cstdlib>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include <unistd.h>
+#include <sys/mman.h>
 
 #define TEX_WIDTH 640
 #define TEX_HEIGHT 480
 #define TEX_DEPTH 40
+#define GEOM_LAYERS 50       // layers geom.glsl emits per instance
+#define TEX_FORMAT GL_RGBA8 // GL_RGBA16F, GL_RGBA32F
+#define TEX_POOL_BUDGET_MB 512
+#define REDUCE_BLOCK 4       // texels folded per axis in each reduction pass
+#define READBACK_NUM 3       // in-flight async readbacks
+#define CFL_TARGET 1.0       // cells travelled per step by the fastest cell
+#define TIMESTEP_INIT 0.001
+#define TIMESTEP_MIN 0.0001
+#define TIMESTEP_MAX 0.01
+#define JACOBI_MIN_ITER 2    // the residual compares the last two iterates of this step
+#define JACOBI_MAX_ITER 20
+#define PRESSURE_TOLERANCE 0.001 // rms pressure change of the last jacobi iteration
+#define BRICK_WIDTH 252      // out-of-core brick interior, in cells
+#define BRICK_HEIGHT 252
+#define BRICK_DEPTH 44
+#define BRICK_HALO 2         // out of core, a backtrace stays within BRICK_HALO-1 cells so interpolation stays in the halo
+#define PREVIEW_MIN_EDGE 64  // out of core, the preview's longest edge is never halved below this
+#define PARTICLE_NUM 1000000
+#define PARTICLE_LIFETIME 600.0f // in simulation steps
 
 struct geomData
 {
@@ -37,6 +63,63 @@ struct geomData
     //TODO: GLuint extraTexIds[3]; // ? phi, phi_n_hat, phi_n_1_hat
 };
 
+struct texDesc
+{
+    GLint internalFormat;
+    GLsizei width;
+    GLsizei height;
+    GLsizei depth;
+};
+
+struct pooledTex
+{
+    GLuint texId;
+    texDesc desc;
+    size_t bytes;
+    bool inUse;
+};
+
+struct texturePool
+{
+    std::vector<pooledTex> textures;
+    size_t budgetBytes;
+    size_t currentBytes;  // resident on GPU, idle textures included
+    size_t peakBytes;
+    size_t liveBytes;     // acquired and not yet released
+    size_t peakLiveBytes;
+};
+
+struct particleData
+{
+    GLuint vaoIds[2];      // one VAO per particle buffer
+    GLuint vboIds[2];      // particle0+1: xyz position in texture space, w age
+    GLuint updateProgram;  // advect & recycle through transform feedback
+    GLuint drawProgram;    // point sprites
+    GLsizei num;
+    int steps;
+};
+
+struct reductionData
+{
+    GLuint vaoId;
+    GLuint vboId;
+    GLuint fboId;
+    GLuint fieldsProgram;  // 3D fields -> first 2D level
+    GLuint reduceProgram;  // 2D level -> next level
+    std::vector<GLuint> levelTexIds;
+    std::vector<GLsizei> levelWidths;
+    std::vector<GLsizei> levelHeights;
+    GLsizei slabTiles;     // z slabs per row of level 0
+    GLuint pboIds[READBACK_NUM];
+    GLsync fences[READBACK_NUM];
+    int readIdx, writeIdx, pending;
+
+    // latest results read back: x max |velocity|, y total density, z sum of squared pressure change
+    GLfloat maxVelocity;
+    GLfloat totalDensity;
+    GLfloat residual;
+};
+
 struct simTexData
 {
   GLuint inputFboId;
@@ -45,17 +128,57 @@ struct simTexData
   std::vector<GLuint> outputTexIds;
   std::string fragShader;
   std::map<std::string, GLfloat> uniforms;
+  std::map<std::string, glm::vec3> vecUniforms;
+};
+
+struct hostField
+{
+    texDesc desc;     // whole domain
+    GLubyte* data;
+    size_t bytes;
+    bool mapped;      // memory-mapped file instead of heap
+};
+
+struct brick
+{
+    GLint origin[3];  // interior origin in domain cells
+    GLsizei size[3];  // interior size, clipped to the domain
+};
+
+struct brickData
+{
+    bool enabled;
+    texDesc domainDesc;
+    GLsizei boxSize[3];  // interior + halo on both sides: the GPU texture size of a brick
+    std::vector<brick> bricks;
+    hostField velFields[2];
+    hostField presFields[2];
+    hostField scalarFields[2];
+    hostField divField;
+    GLuint uploadPboIds[2];
+    GLuint downloadPboIds[2];
+    GLsync fences[2];
+    std::string swapDir;  // empty: fields stay in host memory
+    GLfloat maxVelocity;  // max |velocity| over the full-resolution domain, from the last pass writing it
 };
 
 std::chrono::system_clock::duration deltaT;
 std::chrono::system_clock::time_point lastT;
 
 geomData gData;
+particleData pData;
+texturePool gPool;
+reductionData rData;
+brickData bData;
+texDesc gridDesc = { TEX_FORMAT, TEX_WIDTH, TEX_HEIGHT, TEX_DEPTH };
 int currVelID = 0, resultVelID = 1;
 int currPresID = 0, resultPresID = 1;
 int currScalarID = 0, resultScalarID = 1;
+int currParticleID = 0, resultParticleID = 1;
 
 double count = 0, angle = 0;
+double timestep = TIMESTEP_INIT;
+int jacobiIters = 3;
 glm::vec2 viewport(640,480);
 glm::mat4 window_invert_mvp, window_mvp;
 glm::vec3 force_point( 0, 0, 0 );
@@ -115,7 +238,8 @@ const char *dlGetProvokingMode( int error )
     }
 }
 
-GLuint LoadShader(const char *vertex_path, const char *fragment_path, const char *geom_path) 
+GLuint LoadShader(const char *vertex_path, const char *fragment_path, const char *geom_path,
+                  const std::vector<const GLchar*>& feedbackVaryings = std::vector<const GLchar*>()) 
 {
     // Read shaders
     std::string vertShaderStr = readFile(vertex_path);
@@ -187,6 +311,10 @@ GLuint LoadShader(const char *vertex_path, const char *fragment_path, const char
     if( fragShader != -1 ) glAttachShader(program, fragShader);
     if( geomShader != -1 ) glAttachShader(program, geomShader);
 
+    // transform feedback outputs have to be declared before linking
+    if( !feedbackVaryings.empty() )
+      glTransformFeedbackVaryings(program, feedbackVaryings.size(), feedbackVaryings.data(), GL_INTERLEAVED_ATTRIBS);
+
     glLinkProgram(program);
 
     glGetProgramiv(program, GL_LINK_STATUS, &result);
@@ -202,6 +330,155 @@ GLuint LoadShader(const char *vertex_path, const char *fragment_path, const char
     return program;
 }
 
+size_t texelBytes( GLint internalFormat )
+{
+    switch( internalFormat )
+    {
+      case GL_R8      : return 1;
+      case GL_R16F    : return 2;
+      case GL_R32F    : return 4;
+      case GL_RGBA8   : return 4;
+      case GL_RGBA16F : return 8;
+      case GL_RGBA32F : return 16;
+      default         : return 4;
+    }
+}
+
+size_t texBytes( const texDesc& desc )
+{
+    return texelBytes(desc.internalFormat) * desc.width * desc.height * desc.depth;
+}
+
+// pressure & divergence only use .x: one channel of the same precision.
+texDesc scalarFieldDesc( const texDesc& desc )
+{
+    texDesc scalarDesc = desc;
+    switch( desc.internalFormat )
+    {
+      case GL_RGBA16F : scalarDesc.internalFormat = GL_R16F; break;
+      case GL_RGBA32F : scalarDesc.internalFormat = GL_R32F; break;
+      default         : scalarDesc.internalFormat = GL_R8; break;
+    }
+    return scalarDesc;
+}
+
+// bytes resident for simulate(): velocity, intermediate velocity and the scalar
+// pair at full width, the pressure pair and divergence single-channel.
+size_t simPeakBytes( const texDesc& desc )
+{
+    return 4*texBytes(desc) + 3*texBytes(scalarFieldDesc(desc));
+}
+
+// next lower precision, or false once at RGBA8
+bool lowerFormat( GLint& internalFormat )
+{
+    switch( internalFormat )
+    {
+      case GL_RGBA32F : internalFormat = GL_RGBA16F; return true;
+      case GL_RGBA16F : internalFormat = GL_RGBA8; return true;
+      default         : return false;
+    }
+}
+
+texDesc fitToBudget( texDesc desc, size_t budgetBytes )
+{
+    // lower precision first, then resolution.
+    while( simPeakBytes(desc) > budgetBytes )
+    {
+      if( lowerFormat(desc.internalFormat) )
+        continue;
+      if( desc.width > 1 || desc.height > 1 || desc.depth > 1 )
+      {
+        desc.width = std::max(desc.width/2, 1);
+        desc.height = std::max(desc.height/2, 1);
+        desc.depth = std::max(desc.depth/2, 1);
+      }
+      else
+        break;
+    }
+    return desc;
+}
+
+// a released texture stays resident and is handed to the next acquire of the
+// same format & size; idle textures are only freed to stay within the budget.
+// returns 0 when even without idle textures the new one would exceed the budget.
+GLuint acquireTexture( const texDesc& desc, GLint filter )
+{
+    pooledTex* found = nullptr;
+    for( auto& tex : gPool.textures )
+    {
+      if( !tex.inUse && tex.desc.internalFormat == desc.internalFormat &&
+          tex.desc.width == desc.width && tex.desc.height == desc.height && tex.desc.depth == desc.depth )
+      {
+        found = &tex;
+        break;
+      }
+    }
+
+    if( !found )
+    {
+      size_t bytes = texBytes(desc);
+
+      // make room by dropping idle textures of other shapes
+      if( gPool.currentBytes + bytes > gPool.budgetBytes )
+      {
+        for( auto it = gPool.textures.begin(); it != gPool.textures.end(); )
+        {
+          if( !it->inUse )
+          {
+            glDeleteTextures(1, &it->texId);
+            gPool.currentBytes -= it->bytes;
+            it = gPool.textures.erase(it);
+          }
+          else
+            it++;
+        }
+      }
+      if( gPool.currentBytes + bytes > gPool.budgetBytes )
+      {
+        std::cerr << "Texture pool over budget: " << gPool.currentBytes << " + " << bytes
+                  << " > " << gPool.budgetBytes << " bytes." << std::endl;
+        return 0;
+      }
+
+      pooledTex tex;
+      tex.desc = desc;
+      tex.bytes = bytes;
+      tex.inUse = false;
+      glGenTextures(1, &tex.texId);
+      glBindTexture(GL_TEXTURE_3D, tex.texId);
+      glTexImage3D(GL_TEXTURE_3D, 0, desc.internalFormat, desc.width, desc.height, desc.depth, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+
+      gPool.currentBytes += bytes;
+      gPool.peakBytes = std::max(gPool.peakBytes, gPool.currentBytes);
+      gPool.textures.push_back(tex);
+      found = &gPool.textures.back();
+    }
+
+    found->inUse = true;
+    gPool.liveBytes += found->bytes;
+    gPool.peakLiveBytes = std::max(gPool.peakLiveBytes, gPool.liveBytes);
+    glBindTexture(GL_TEXTURE_3D, found->texId);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, filter);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, filter);
+    glBindTexture(GL_TEXTURE_3D, 0);
+    return found->texId;
+}
+
+void releaseTexture( GLuint& texId )
+{
+    for( auto& tex : gPool.textures )
+    {
+      if( tex.texId == texId && tex.inUse )
+      {
+        tex.inUse = false;
+        gPool.liveBytes -= tex.bytes;
+        break;
+      }
+    }
+    texId = 0;
+}
+
 void bindInputTexture( const simTexData& texData )
 {
      // bind input texture
@@ -229,6 +506,13 @@ void setupUnifom( GLint program, const simTexData& texData )
      }
    }
 
+   for( auto& uniform : texData.vecUniforms ) {
+     loc = glGetUniformLocation(program, uniform.first.c_str());
+     if( loc != -1 ) {
+       glUniform3fv(loc, 1, glm::value_ptr(uniform.second));
+     }
+   }
+
    for( auto i = 0; i < texData.inputTexIds.size(); i++ )
    {
      loc = glGetUniformLocation(program, texData.inputTexNames[i].c_str());
@@ -241,7 +525,6 @@ void setupUnifom( GLint program, const simTexData& texData )
    if( forcePointID != -1 )
    {
      glUniform3fv(forcePointID, 1, glm::value_ptr(force_point));
-     force_point = glm::vec3(0.0);
    }
 }
 
@@ -296,7 +579,7 @@ void drawToTexture( const simTexData& texData )
    glEnableVertexAttribArray(2);
 
    glBindFramebuffer(GL_FRAMEBUFFER, texData.inputFboId);
-   glViewport( 0.0, 0.0, TEX_WIDTH, TEX_HEIGHT );
+   glViewport( 0.0, 0.0, texData.uniforms.at("texWidth"), texData.uniforms.at("texHeight") );
 
    std::vector<GLenum> attachments;
    attachments.reserve(texData.outputTexIds.size());
@@ -316,7 +599,12 @@ void drawToTexture( const simTexData& texData )
    bindInputTexture( texData );
 
    // set uniform variables if any
-   GLint program = LoadShader("vertex.glsl",texData.fragShader.c_str(),"geom.glsl");
+   // compile each pass once: out of core, every pass is drawn once per brick.
+   static std::map<std::string, GLuint> programs;
+   auto cached = programs.find(texData.fragShader);
+   if( cached == programs.end() )
+     cached = programs.insert(std::make_pair(texData.fragShader, LoadShader("vertex.glsl",texData.fragShader.c_str(),"geom.glsl"))).first;
+   GLint program = cached->second;
    glUseProgram( program );
 
    setupUnifom( program, texData );
@@ -325,8 +613,9 @@ void drawToTexture( const simTexData& texData )
    //glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
    //glClear(GL_COLOR_BUFFER_BIT);
 
-   // draw elements
-   glDrawArrays(GL_TRIANGLES, 0, 6);
+   // draw elements, one instance per GEOM_LAYERS layers of the target
+   GLsizei layerInstances = (GLsizei(texData.uniforms.at("texDepth")) + GEOM_LAYERS - 1)/GEOM_LAYERS;
+   glDrawArraysInstanced(GL_TRIANGLES, 0, 6, layerInstances);
    
    // GL3 requires shader anyway.
    error = glGetError();
@@ -439,8 +728,12 @@ void drawToScreen( const simTexData& texData )
    error = glGetError();
    printf("glGetError: %s\n", dlGetErrorString(error) );
 
-   // load shader
-   GLint program = LoadShader("vertex_screen.glsl",texData.fragShader.c_str(),nullptr);
+   // load shader, compiled once: it's drawn every frame.
+   static std::map<std::string, GLuint> programs;
+   auto cached = programs.find(texData.fragShader);
+   if( cached == programs.end() )
+     cached = programs.insert(std::make_pair(texData.fragShader, LoadShader("vertex_screen.glsl",texData.fragShader.c_str(),nullptr))).first;
+   GLint program = cached->second;
    glUseProgram( program );
 
    // matrix
@@ -485,11 +778,10 @@ void drawToScreen( const simTexData& texData )
    glDisable(GL_CULL_FACE);
    glDisable(GL_DEPTH_TEST);
 
-   glutSwapBuffers();
-
    glDisableVertexAttribArray(0);
    glDisableVertexAttribArray(1);
    glDeleteBuffers(2, vboId);
+   glDeleteBuffers(1, &iboId);
 }
 
 void initGeomData()
@@ -522,6 +814,504 @@ void initGeomData()
    glEnableVertexAttribArray(1);
 }
 
+void texTransfer( GLint internalFormat, GLenum& format, GLenum& type )
+{
+    switch( internalFormat )
+    {
+      case GL_R8      : format = GL_RED;  type = GL_UNSIGNED_BYTE; break;
+      case GL_R16F    : format = GL_RED;  type = GL_HALF_FLOAT; break;
+      case GL_R32F    : format = GL_RED;  type = GL_FLOAT; break;
+      case GL_RGBA16F : format = GL_RGBA; type = GL_HALF_FLOAT; break;
+      case GL_RGBA32F : format = GL_RGBA; type = GL_FLOAT; break;
+      default         : format = GL_RGBA; type = GL_UNSIGNED_BYTE; break;
+    }
+}
+
+GLint fieldFilter( const texDesc& desc )
+{
+    // vector fields are sampled in between cells, scalar fields per cell
+    GLenum format, type;
+    texTransfer( desc.internalFormat, format, type );
+    return (format == GL_RED) ? GL_NEAREST : GL_LINEAR;
+}
+
+void allocHostField( hostField& field, const texDesc& desc, const char* name )
+{
+    field.desc = desc;
+    field.bytes = texBytes(desc);
+    field.mapped = false;
+
+    if( !bData.swapDir.empty() )
+    {
+      // unique name so processes sharing a swap directory never truncate
+      // each other's mapping; unlinked right away, it only backs the mapping
+      std::string path = bData.swapDir + "/" + name + ".XXXXXX";
+      std::vector<char> pathBuf(path.begin(), path.end());
+      pathBuf.push_back('\0');
+      int fd = mkstemp(pathBuf.data());
+      if( fd != -1 ) path = pathBuf.data();
+      if( fd != -1 && ftruncate(fd, field.bytes) == 0 )
+      {
+        void* data = mmap(0, field.bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if( data != MAP_FAILED )
+        {
+          field.data = (GLubyte*)data;
+          field.mapped = true;
+        }
+      }
+      if( fd != -1 )
+      {
+        close(fd);
+        unlink(path.c_str());
+      }
+      if( field.mapped ) return;
+      std::cerr << "Could not map file " << path << ". Using host memory." << std::endl;
+    }
+
+    field.data = new GLubyte[field.bytes];
+}
+
+GLint wrapCell( GLint cell, GLsizei size )
+{
+    return ((cell % size) + size) % size;
+}
+
+// copy a box of the domain, wrapping out-of-domain cells around it like the
+// in-core textures do: they keep the default GL_REPEAT wrap mode.
+void gatherBox( const hostField& field, const GLint origin[3], const GLsizei size[3], GLubyte* dst )
+{
+    const texDesc& desc = field.desc;
+    size_t tb = texelBytes(desc.internalFormat);
+    GLint x0 = std::max(origin[0], 0);
+    GLint x1 = std::max(std::min(origin[0] + size[0], desc.width), x0);
+
+    for( GLint z = 0; z < size[2]; z++ )
+    {
+      GLint gz = wrapCell(origin[2] + z, desc.depth);
+      for( GLint y = 0; y < size[1]; y++ )
+      {
+        GLint gy = wrapCell(origin[1] + y, desc.height);
+        const GLubyte* row = field.data + (size_t(gz)*desc.height + gy)*desc.width*tb;
+        GLubyte* out = dst + (size_t(z)*size[1] + y)*size[0]*tb;
+
+        for( GLint x = origin[0]; x < x0; x++ )
+          memcpy(out + (x - origin[0])*tb, row + wrapCell(x, desc.width)*tb, tb);
+        memcpy(out + (x0 - origin[0])*tb, row + x0*tb, (x1 - x0)*tb);
+        for( GLint x = x1; x < origin[0] + size[0]; x++ )
+          memcpy(out + (x - origin[0])*tb, row + wrapCell(x, desc.width)*tb, tb);
+      }
+    }
+}
+
+GLfloat halfToFloat( uint16_t h )
+{
+    int exponent = (h >> 10) & 0x1f;
+    GLfloat mantissa = GLfloat(h & 0x3ff);
+    GLfloat value = (exponent == 0) ? std::ldexp(mantissa, -24)
+                                    : std::ldexp(mantissa + 1024.0f, exponent - 25);
+    return (h & 0x8000) ? -value : value;
+}
+
+// |xyz| of one texel of a vector field
+GLfloat texelLength( const GLubyte* texel, GLint internalFormat )
+{
+    GLfloat v[3];
+    for( int i = 0; i < 3; i++ )
+    {
+      switch( internalFormat )
+      {
+        case GL_RGBA16F : { uint16_t h; memcpy(&h, texel + 2*i, 2); v[i] = halfToFloat(h); break; }
+        case GL_RGBA32F : memcpy(&v[i], texel + 4*i, 4); break;
+        default         : v[i] = texel[i]/255.0f; break;
+      }
+    }
+    return std::sqrt(v[0]*v[0] + v[1]*v[1] + v[2]*v[2]);
+}
+
+// max |xyz| over a downloaded brick's interior
+GLfloat interiorMaxLength( const hostField& field, const brick& br, const GLubyte* src )
+{
+    const GLsizei* box = bData.boxSize;
+    size_t tb = texelBytes(field.desc.internalFormat);
+    GLfloat maxLength = 0.0f;
+    for( GLint z = 0; z < br.size[2]; z++ )
+      for( GLint y = 0; y < br.size[1]; y++ )
+      {
+        const GLubyte* in = src + ((size_t(z + BRICK_HALO)*box[1] + y + BRICK_HALO)*box[0] + BRICK_HALO)*tb;
+        for( GLint x = 0; x < br.size[0]; x++, in += tb )
+          maxLength = std::max(maxLength, texelLength(in, field.desc.internalFormat));
+      }
+    return maxLength;
+}
+
+// copy a brick's interior back, dropping the halo.
+void scatterInterior( hostField& field, const brick& br, const GLubyte* src )
+{
+    const texDesc& desc = field.desc;
+    const GLsizei* box = bData.boxSize;
+    size_t tb = texelBytes(desc.internalFormat);
+
+    for( GLint z = 0; z < br.size[2]; z++ )
+    {
+      for( GLint y = 0; y < br.size[1]; y++ )
+      {
+        const GLubyte* in = src + ((size_t(z + BRICK_HALO)*box[1] + y + BRICK_HALO)*box[0] + BRICK_HALO)*tb;
+        GLubyte* row = field.data + ((size_t(br.origin[2] + z)*desc.height + br.origin[1] + y)*desc.width + br.origin[0])*tb;
+        memcpy(row, in, br.size[0]*tb);
+      }
+    }
+}
+
+// GPU bytes of the two brick slots: per slot at most four full-width boxes (advect) and
+// three single-channel ones (diffuse), kept resident by the pool between passes.
+size_t brickWorkingBytes( GLint internalFormat, const GLsizei brickSize[3] )
+{
+    texDesc boxDesc = { internalFormat, brickSize[0] + 2*BRICK_HALO, brickSize[1] + 2*BRICK_HALO, brickSize[2] + 2*BRICK_HALO };
+    return 2*simPeakBytes(boxDesc);
+}
+
+void initBricks( texDesc domain, GLint maxTexSize )
+{
+    bData.enabled = true;
+
+    // the smallest preview still worth rendering & reducing
+    texDesc minPreview = domain;
+    while( std::max(minPreview.width, std::max(minPreview.height, minPreview.depth)) > std::min(PREVIEW_MIN_EDGE, maxTexSize) )
+    {
+      minPreview.width = std::max(minPreview.width/2, 1);
+      minPreview.height = std::max(minPreview.height/2, 1);
+      minPreview.depth = std::max(minPreview.depth/2, 1);
+    }
+
+    // the budget sizes the bricks: the largest axis halves until both slots and the smallest
+    // preview fit. precision is lowered only when not even single-cell bricks fit.
+    GLsizei brickSize[3];
+    GLsizei domainSize[3] = { domain.width, domain.height, domain.depth };
+    for( ;; )
+    {
+      GLsizei maxBrick[3] = { BRICK_WIDTH, BRICK_HEIGHT, BRICK_DEPTH };
+      for( int i = 0; i < 3; i++ )
+        brickSize[i] = std::min(std::min(maxBrick[i], domainSize[i]), maxTexSize - 2*BRICK_HALO);
+
+      minPreview.internalFormat = domain.internalFormat;
+      while( brickWorkingBytes(domain.internalFormat, brickSize) + simPeakBytes(minPreview) > gPool.budgetBytes &&
+             (brickSize[0] > 1 || brickSize[1] > 1 || brickSize[2] > 1) )
+      {
+        GLsizei* largest = std::max_element(brickSize, brickSize + 3);
+        *largest = std::max(*largest/2, 1);
+      }
+      if( brickWorkingBytes(domain.internalFormat, brickSize) + simPeakBytes(minPreview) <= gPool.budgetBytes )
+        break;
+      if( !lowerFormat(domain.internalFormat) )
+      {
+        std::cerr << "Texture budget of " << gPool.budgetBytes << " bytes can't hold two bricks and a "
+                  << minPreview.width << "x" << minPreview.height << "x" << minPreview.depth << " preview." << std::endl;
+        exit(EXIT_FAILURE);
+      }
+    }
+    for( int i = 0; i < 3; i++ )
+      bData.boxSize[i] = brickSize[i] + 2*BRICK_HALO;
+    bData.domainDesc = domain;
+
+    for( GLint z = 0; z < domain.depth; z += brickSize[2] )
+      for( GLint y = 0; y < domain.height; y += brickSize[1] )
+        for( GLint x = 0; x < domain.width; x += brickSize[0] )
+        {
+          brick br = { { x, y, z },
+                       { std::min(brickSize[0], domain.width - x),
+                         std::min(brickSize[1], domain.height - y),
+                         std::min(brickSize[2], domain.depth - z) } };
+          bData.bricks.push_back(br);
+        }
+
+    texDesc scalarDesc = scalarFieldDesc(domain);
+    allocHostField( bData.velFields[0], domain, "velocity0" );
+    allocHostField( bData.velFields[1], domain, "velocity1" );
+    allocHostField( bData.scalarFields[0], domain, "scalar0" );
+    allocHostField( bData.scalarFields[1], domain, "scalar1" );
+    allocHostField( bData.presFields[0], scalarDesc, "pressure0" );
+    allocHostField( bData.presFields[1], scalarDesc, "pressure1" );
+    allocHostField( bData.divField, scalarDesc, "divergence" );
+
+    glGenBuffers(2, bData.uploadPboIds);
+    glGenBuffers(2, bData.downloadPboIds);
+    bData.fences[0] = bData.fences[1] = 0;
+
+    // rows of R8 bricks needn't be 4-byte aligned
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    // the rest of the budget holds the preview grid that is rendered & reduced,
+    // halved no further than minPreview, which fits by construction.
+    size_t previewBudget = gPool.budgetBytes - brickWorkingBytes(domain.internalFormat, brickSize);
+    texDesc preview = domain;
+    while( (preview.width > maxTexSize || preview.height > maxTexSize || preview.depth > maxTexSize ||
+            simPeakBytes(preview) > previewBudget) &&
+           (preview.width > minPreview.width || preview.height > minPreview.height || preview.depth > minPreview.depth) )
+    {
+      preview.width = std::max(preview.width/2, 1);
+      preview.height = std::max(preview.height/2, 1);
+      preview.depth = std::max(preview.depth/2, 1);
+    }
+    gridDesc = preview;
+
+    size_t hostBytes = 4*texBytes(domain) + 3*texBytes(scalarDesc);
+    printf("out of core: domain %dx%dx%d, %lu bricks of %dx%dx%d, %lu bytes in %s\n",
+           domain.width, domain.height, domain.depth, bData.bricks.size(),
+           bData.boxSize[0], bData.boxSize[1], bData.boxSize[2], hostBytes,
+           bData.swapDir.empty() ? "host memory" : bData.swapDir.c_str());
+}
+
+// run one pass over the whole domain, brick by brick, through a fixed GPU working set.
+// inputs are gathered with their halo from host fields written by earlier passes, so halos
+// are exchanged between passes. two slots let brick b upload & compute while brick b-1 downloads.
+// returns false, leaving the outputs untouched, when the pool can't hold the slots.
+bool streamBricks( simTexData& texData, const std::vector<hostField*>& inputs, const std::vector<hostField*>& outputs )
+{
+    const GLsizei* box = bData.boxSize;
+    texData.uniforms["texWidth"] = box[0];
+    texData.uniforms["texHeight"] = box[1];
+    texData.uniforms["texDepth"] = box[2];
+
+    std::vector<GLuint> inputTexIds[2], outputTexIds[2];
+    std::vector<size_t> inputBytes, outputBytes;
+    size_t inputTotal = 0, outputTotal = 0;
+    for( auto field : inputs )
+    {
+      texDesc desc = { field->desc.internalFormat, box[0], box[1], box[2] };
+      inputBytes.push_back(texBytes(desc));
+      inputTotal += inputBytes.back();
+      for( int slot = 0; slot < 2; slot++ )
+        inputTexIds[slot].push_back( acquireTexture( desc, fieldFilter(desc) ) );
+    }
+    for( auto field : outputs )
+    {
+      texDesc desc = { field->desc.internalFormat, box[0], box[1], box[2] };
+      outputBytes.push_back(texBytes(desc));
+      outputTotal += outputBytes.back();
+      for( int slot = 0; slot < 2; slot++ )
+        outputTexIds[slot].push_back( acquireTexture( desc, fieldFilter(desc) ) );
+    }
+    bool acquired = true;
+    for( int slot = 0; slot < 2; slot++ )
+    {
+      for( auto texId : inputTexIds[slot] ) acquired = acquired && texId;
+      for( auto texId : outputTexIds[slot] ) acquired = acquired && texId;
+    }
+    if( !acquired )
+    {
+      for( int slot = 0; slot < 2; slot++ )
+      {
+        for( auto& texId : inputTexIds[slot] ) releaseTexture( texId );
+        for( auto& texId : outputTexIds[slot] ) releaseTexture( texId );
+      }
+      return false;
+    }
+
+    // the velocity the next advection reads is measured at full resolution while it streams back
+    hostField* velocityField = &bData.velFields[currVelID];
+    if( std::find(outputs.begin(), outputs.end(), velocityField) != outputs.end() )
+      bData.maxVelocity = 0.0f;
+
+    GLenum format, type;
+    for( size_t b = 0; b <= bData.bricks.size(); b++ )
+    {
+      int slot = b % 2;
+      if( b < bData.bricks.size() )
+      {
+        const brick& br = bData.bricks[b];
+        GLint boxOrigin[3] = { br.origin[0] - BRICK_HALO, br.origin[1] - BRICK_HALO, br.origin[2] - BRICK_HALO };
+
+        // upload: orphan the PBO so filling it doesn't wait for the draw still reading its last contents
+        if( !inputs.empty() )
+        {
+          glBindBuffer(GL_PIXEL_UNPACK_BUFFER, bData.uploadPboIds[slot]);
+          glBufferData(GL_PIXEL_UNPACK_BUFFER, inputTotal, 0, GL_STREAM_DRAW);
+          GLubyte* staging = (GLubyte*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, inputTotal,
+                                                        GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+          size_t offset = 0;
+          for( int i = 0; i < inputs.size(); i++ )
+          {
+            if( staging ) gatherBox( *inputs[i], boxOrigin, box, staging + offset );
+            offset += inputBytes[i];
+          }
+          glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+          offset = 0;
+          for( int i = 0; i < inputs.size(); i++ )
+          {
+            texTransfer( inputs[i]->desc.internalFormat, format, type );
+            glBindTexture(GL_TEXTURE_3D, inputTexIds[slot][i]);
+            glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, 0, box[0], box[1], box[2], format, type, (void*)offset);
+            offset += inputBytes[i];
+          }
+          glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        }
+
+        texData.inputTexIds = inputTexIds[slot];
+        texData.outputTexIds = outputTexIds[slot];
+        texData.vecUniforms["brickOffset"] = glm::vec3(boxOrigin[0], boxOrigin[1], boxOrigin[2]);
+        drawToTexture( texData );
+
+        // download into the slot's PBO, collected after the next brick is queued
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, bData.downloadPboIds[slot]);
+        glBufferData(GL_PIXEL_PACK_BUFFER, outputTotal, 0, GL_STREAM_READ);
+        size_t offset = 0;
+        for( int i = 0; i < outputs.size(); i++ )
+        {
+          texTransfer( outputs[i]->desc.internalFormat, format, type );
+          glBindTexture(GL_TEXTURE_3D, outputTexIds[slot][i]);
+          glGetTexImage(GL_TEXTURE_3D, 0, format, type, (void*)offset);
+          offset += outputBytes[i];
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        glBindTexture(GL_TEXTURE_3D, 0);
+        bData.fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+      }
+
+      if( b > 0 )
+      {
+        int prevSlot = (b - 1) % 2;
+        while( glClientWaitSync(bData.fences[prevSlot], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED );
+        glDeleteSync(bData.fences[prevSlot]);
+        bData.fences[prevSlot] = 0;
+
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, bData.downloadPboIds[prevSlot]);
+        const GLubyte* result = (const GLubyte*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, outputTotal, GL_MAP_READ_BIT);
+        if( result )
+        {
+          size_t offset = 0;
+          for( int i = 0; i < outputs.size(); i++ )
+          {
+            scatterInterior( *outputs[i], bData.bricks[b - 1], result + offset );
+            if( outputs[i] == velocityField )
+              bData.maxVelocity = std::max(bData.maxVelocity, interiorMaxLength( *outputs[i], bData.bricks[b - 1], result + offset ));
+            offset += outputBytes[i];
+          }
+          glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+      }
+    }
+
+    for( int slot = 0; slot < 2; slot++ )
+    {
+      for( auto& texId : inputTexIds[slot] ) releaseTexture( texId );
+      for( auto& texId : outputTexIds[slot] ) releaseTexture( texId );
+    }
+    return true;
+}
+
+// nearest-sample a host field into a preview-sized texture
+void sampleField( const hostField& field, GLuint texId, const texDesc& desc )
+{
+    size_t tb = texelBytes(field.desc.internalFormat);
+    std::vector<GLubyte> samples( tb*desc.width*desc.height*desc.depth );
+    GLubyte* out = samples.data();
+    for( GLint z = 0; z < desc.depth; z++ )
+    {
+      GLint gz = GLint(size_t(z)*field.desc.depth/desc.depth);
+      for( GLint y = 0; y < desc.height; y++ )
+      {
+        GLint gy = GLint(size_t(y)*field.desc.height/desc.height);
+        const GLubyte* row = field.data + (size_t(gz)*field.desc.height + gy)*field.desc.width*tb;
+        for( GLint x = 0; x < desc.width; x++, out += tb )
+          memcpy(out, row + (size_t(x)*field.desc.width/desc.width)*tb, tb);
+      }
+    }
+
+    GLenum format, type;
+    texTransfer( field.desc.internalFormat, format, type );
+    glBindTexture(GL_TEXTURE_3D, texId);
+    glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, 0, desc.width, desc.height, desc.depth, format, type, samples.data());
+    glBindTexture(GL_TEXTURE_3D, 0);
+}
+
+// keep the preview texture at the current ping-pong index, whichever slot holds it
+GLuint previewTexture( GLuint texIds[2], int currID, const texDesc& desc )
+{
+    if( !texIds[currID] ) std::swap(texIds[0], texIds[1]);
+    if( !texIds[currID] ) texIds[currID] = acquireTexture( desc, fieldFilter(desc) );
+    return texIds[currID];
+}
+
+// the preview grid stands in for the domain in reduction, particles & rendering
+bool refreshPreview()
+{
+    texDesc scalarDesc = scalarFieldDesc(gridDesc);
+    GLuint velTexId = previewTexture( gData.velTexIds, currVelID, gridDesc );
+    GLuint scalarTexId = previewTexture( gData.scalarTexIds, currScalarID, gridDesc );
+    GLuint presTexId = previewTexture( gData.presTexIds, currPresID, scalarDesc );
+    gData.presTexIds[resultPresID] = acquireTexture( scalarDesc, GL_NEAREST );
+    if( !velTexId || !scalarTexId || !presTexId || !gData.presTexIds[resultPresID] )
+      return false;
+
+    sampleField( bData.velFields[currVelID], velTexId, gridDesc );
+    sampleField( bData.scalarFields[currScalarID], scalarTexId, gridDesc );
+    sampleField( bData.presFields[currPresID], presTexId, scalarDesc );
+    sampleField( bData.presFields[resultPresID], gData.presTexIds[resultPresID], scalarDesc );
+    return true;
+}
+
+// out of core the timestep is bounded by the halo, from the exact max |velocity|: a backtrace
+// leaving the halo would wrap around the brick texture. no TIMESTEP_MIN floor here.
+void haloTimestep()
+{
+  const texDesc& domain = bData.domainDesc;
+  GLsizei maxDim = std::max(domain.width, std::max(domain.height, domain.depth));
+  double maxCells = std::min(CFL_TARGET, BRICK_HALO - 1.0);
+  timestep = (bData.maxVelocity > 0.0f) ? maxCells/(bData.maxVelocity*maxDim) : TIMESTEP_MAX;
+  timestep = std::min(timestep, TIMESTEP_MAX);
+}
+
+// false when the pool couldn't hold a pass; the step stops there.
+bool stepBricks( simTexData& texData )
+{
+  // 1. advect
+  texData.inputTexNames = { "velocity", "scalar" };
+  texData.fragShader = "frag_pass1_advect.glsl";
+  if( !streamBricks( texData, { &bData.velFields[currVelID], &bData.scalarFields[currScalarID] },
+                              { &bData.velFields[resultVelID], &bData.scalarFields[resultScalarID] } ) )
+    return false;
+  currScalarID = resultScalarID;
+  resultScalarID = (1-currScalarID);
+
+  // 2. divergence
+  texData.inputTexNames = { "velocity" };
+  texData.fragShader = "frag_pass2_divergence.glsl";
+  if( !streamBricks( texData, { &bData.velFields[resultVelID] }, { &bData.divField } ) )
+    return false;
+
+  // 3. diffuse, one streamed pass per jacobi iteration
+  for( int i = 0; i < jacobiIters; i++ )
+  {
+    texData.inputTexNames = { "pressure", "divergence" };
+    texData.uniforms["rAlpha"] = 1.0/timestep;
+    texData.uniforms["rBeta"] = 1.0f/(4+texData.uniforms["rAlpha"]);
+    texData.fragShader = "frag_pass3_diffuse.glsl";
+    if( !streamBricks( texData, { &bData.presFields[currPresID], &bData.divField }, { &bData.presFields[resultPresID] } ) )
+      return false;
+
+    currPresID = resultPresID;
+    resultPresID = (1-currPresID);
+  }
+
+  // 4. projection
+  texData.inputTexNames = { "velocity", "pressure" };
+  texData.fragShader = "frag_pass4_proj.glsl";
+  if( !streamBricks( texData, { &bData.velFields[resultVelID], &bData.presFields[currPresID] }, { &bData.velFields[currVelID] } ) )
+    return false;
+
+  texData.uniforms["texWidth"] = gridDesc.width;
+  texData.uniforms["texHeight"] = gridDesc.height;
+  texData.uniforms["texDepth"] = gridDesc.depth;
+  texData.vecUniforms["brickOffset"] = glm::vec3(0.0);
+  if( !refreshPreview() )
+    return false;
+  haloTimestep();
+  return true;
+}
+
 void initialize()
 {
   // default VAO for gl3 core-profile.
@@ -531,120 +1321,467 @@ void initialize()
   // define FBO
   glGenFramebuffers(1, &gData.fboId);
 
-  // all textures: input & output
-  static int BUF_NUM = 2;
-  glGenTextures(BUF_NUM, gData.velTexIds);
-  glGenTextures(BUF_NUM, gData.presTexIds);
-  glGenTextures(BUF_NUM, gData.scalarTexIds);
-  glGenTextures(1, &gData.divTexId);
-  for( int i = 0; i < BUF_NUM; i++) 
+  // persistent textures: the current velocity, pressure & scalar.
+  // the other halves of the ping-pong pairs and divergence are acquired per step.
+  // a grid that only fits by lowering resolution, or not at all, runs out of core at full
+  // resolution; gridDesc then becomes the preview grid.
+  GLint maxTexSize;
+  glGetIntegerv(GL_MAX_3D_TEXTURE_SIZE, &maxTexSize);
+  texDesc fitted = fitToBudget( gridDesc, gPool.budgetBytes );
+  if( std::max(gridDesc.width, std::max(gridDesc.height, gridDesc.depth)) > maxTexSize ||
+      fitted.width != gridDesc.width || fitted.height != gridDesc.height || fitted.depth != gridDesc.depth )
   {
-    glBindTexture(GL_TEXTURE_3D, gData.velTexIds[i]);
-    glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA, TEX_WIDTH, TEX_HEIGHT, TEX_DEPTH, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
-    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-
-    glBindTexture(GL_TEXTURE_3D, gData.presTexIds[i]);
-    glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA, TEX_WIDTH, TEX_HEIGHT, TEX_DEPTH, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
-    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-
-    glBindTexture(GL_TEXTURE_3D, gData.scalarTexIds[i]);
-    glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA, TEX_WIDTH, TEX_HEIGHT, TEX_DEPTH, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
-    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    initBricks( gridDesc, maxTexSize );
   }
-  
-  // temp divergence tex
-  glBindTexture(GL_TEXTURE_3D, gData.divTexId);
-  glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA, TEX_WIDTH, TEX_HEIGHT, TEX_DEPTH, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
-  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  else
+  {
+    gridDesc = fitted;
+  }
+  printf("grid: %dx%dx%d, format 0x%x, peak %lu bytes, budget %lu bytes\n",
+         gridDesc.width, gridDesc.height, gridDesc.depth, gridDesc.internalFormat, simPeakBytes(gridDesc), gPool.budgetBytes);
 
-  glBindTexture(GL_TEXTURE_3D, 0);
+  gData.velTexIds[0] = acquireTexture( gridDesc, GL_LINEAR );
+  gData.presTexIds[0] = acquireTexture( scalarFieldDesc(gridDesc), GL_NEAREST );
+  gData.scalarTexIds[0] = acquireTexture( gridDesc, GL_LINEAR );
+  if( !gData.velTexIds[0] || !gData.presTexIds[0] || !gData.scalarTexIds[0] )
+  {
+    std::cerr << "Could not allocate the simulation textures." << std::endl;
+    exit(EXIT_FAILURE);
+  }
 
   //init state
   simTexData initData;
 
-  initData.uniforms["texWidth"] = TEX_WIDTH;
-  initData.uniforms["texHeight"] = TEX_HEIGHT;
-  initData.uniforms["texDepth"] = TEX_DEPTH;
+  initData.uniforms["texWidth"] = gridDesc.width;
+  initData.uniforms["texHeight"] = gridDesc.height;
+  initData.uniforms["texDepth"] = gridDesc.depth;
+  initData.vecUniforms["brickOffset"] = glm::vec3(0.0);
+  initData.vecUniforms["domainSize"] = glm::vec3(gridDesc.width, gridDesc.height, gridDesc.depth);
 
   initData.inputFboId = gData.fboId;
   initData.inputTexIds = {};
   initData.outputTexIds = {gData.velTexIds[0], gData.presTexIds[0], gData.scalarTexIds[0] };
   initData.fragShader = "frag_init_all.glsl";
-  drawToTexture( initData );
+
+  if( bData.enabled )
+  {
+    const texDesc& domain = bData.domainDesc;
+    initData.vecUniforms["domainSize"] = glm::vec3(domain.width, domain.height, domain.depth);
+    if( !streamBricks( initData, {}, { &bData.velFields[0], &bData.presFields[0], &bData.scalarFields[0] } ) )
+    {
+      std::cerr << "Could not allocate the brick textures." << std::endl;
+      exit(EXIT_FAILURE);
+    }
+
+    sampleField( bData.velFields[0], gData.velTexIds[0], gridDesc );
+    sampleField( bData.presFields[0], gData.presTexIds[0], scalarFieldDesc(gridDesc) );
+    sampleField( bData.scalarFields[0], gData.scalarTexIds[0], gridDesc );
+    haloTimestep();
+  }
+  else
+  {
+    drawToTexture( initData );
+  }
 }
 
-void simulate()
+void initParticles()
 {
-  simTexData texData;
-  texData.uniforms["texWidth"] = TEX_WIDTH;
-  texData.uniforms["texHeight"] = TEX_HEIGHT;
-  texData.uniforms["texDepth"] = TEX_DEPTH;
-  
+  // particle state lives only on GPU: ping-pong buffers, filled by the first update pass.
+  glGenVertexArrays(2, pData.vaoIds);
+  glGenBuffers(2, pData.vboIds);
+  for( int i = 0; i < 2; i++ )
   {
-    texData.uniforms["currTime"] = count;
-    //std::chrono::duration_cast<std::chrono::seconds>(deltaT).count();
+    glBindVertexArray(pData.vaoIds[i]);
+    glBindBuffer(GL_ARRAY_BUFFER, pData.vboIds[i]);
+    glBufferData(GL_ARRAY_BUFFER, pData.num*4*sizeof(GLfloat), 0, GL_DYNAMIC_COPY);
+    glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 0, (void*)0);
+    glEnableVertexAttribArray(0);
+  }
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  glBindVertexArray(gData.vaoId);
 
-    // 1. advect: 
-    // input: velocity, scalar
-    // output: intermediate velocity
-    texData.inputFboId = gData.fboId;
-    texData.inputTexIds = { gData.velTexIds[currVelID], gData.scalarTexIds[currScalarID] };
-    texData.inputTexNames = { "velocity", "scalar" };
-    texData.outputTexIds = { gData.velTexIds[resultVelID], gData.scalarTexIds[resultScalarID] };
-    texData.uniforms["amtT"] = 300.0;
-    texData.uniforms["buoyAlpha"] = 0.34;
-    texData.uniforms["buoyBeta"] = 1.3;
-    texData.fragShader = "frag_pass1_advect.glsl";
-    drawToTexture( texData );
+  GLenum error = glGetError();
+  printf("particle buffers: %d x %lu bytes, %s\n", pData.num, 4*sizeof(GLfloat), dlGetErrorString(error) );
+
+  // compile once: these run every frame on millions of points.
+  pData.updateProgram = LoadShader("vertex_particle_update.glsl", nullptr, nullptr, { "out_Particle" });
+  pData.drawProgram = LoadShader("vertex_particle.glsl", "frag_particle.glsl", nullptr);
+  pData.steps = 0;
+}
 
-    currScalarID = resultScalarID;
-    resultScalarID = (1-currScalarID);
+void updateParticles( const simTexData& texData )
+{
+  glUseProgram( pData.updateProgram );
+  bindInputTexture( texData );
+  setupUnifom( pData.updateProgram, texData );
+
+  GLuint emitterPosID = glGetUniformLocation(pData.updateProgram, "emitterPos");
+  glUniform3f(emitterPosID, 0.5f, 0.1f, 0.5f);
+
+  // advect current buffer into result buffer, no rasterization.
+  glBindVertexArray(pData.vaoIds[currParticleID]);
+  glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, pData.vboIds[resultParticleID]);
+  glEnable(GL_RASTERIZER_DISCARD);
+  glBeginTransformFeedback(GL_POINTS);
+  glDrawArrays(GL_POINTS, 0, pData.num);
+  glEndTransformFeedback();
+  glDisable(GL_RASTERIZER_DISCARD);
+  glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
 
-    // apply force in advect pharse
+  glBindVertexArray(gData.vaoId);
+  glUseProgram(0);
 
-    // 2. divergence: 
-    // input: intermediate velocity
-    // output: intermediate divergence
-    texData.inputFboId = gData.fboId;
-    texData.inputTexIds = { gData.velTexIds[resultVelID]};
-    texData.inputTexNames = { "velocity" };
-    texData.outputTexIds = { gData.divTexId };
-    texData.fragShader = "frag_pass2_divergence.glsl";
-    drawToTexture( texData );
+  currParticleID = resultParticleID;
+  resultParticleID = (1-currParticleID);
+  pData.steps++;
+}
 
-    // can run jacobi iteration multiple times.
-    for( int i = 0; i <3; i++ )
-    {
-      // 3. diffuse
-      // input: pressure & intermediate divergence
-      // output: updated pressure
-      texData.inputFboId = gData.fboId;
-      texData.inputTexIds = { gData.presTexIds[currPresID], gData.divTexId };
-      texData.inputTexNames = { "pressure", "divergence" };
-      texData.outputTexIds = { gData.presTexIds[resultPresID] };
-      texData.uniforms["rAlpha"] = 1.0/count;
-      texData.uniforms["rBeta"] = 1.0f/(4+texData.uniforms["rAlpha"]);
-      texData.fragShader = "frag_pass3_diffuse.glsl";
-      drawToTexture( texData );
+void drawParticles( const simTexData& texData )
+{
+  glUseProgram( pData.drawProgram );
+  setupUnifom( pData.drawProgram, texData );
+
+  GLuint MatrixID = glGetUniformLocation(pData.drawProgram, "MVP");
+  glUniformMatrix4fv(MatrixID, 1, GL_FALSE, &window_mvp[0][0]);
 
-      currPresID = resultPresID;
-      resultPresID = (1-currPresID);
+  // additive point sprites on top of the ray-marched volume
+  glEnable(GL_PROGRAM_POINT_SIZE);
+  glEnable(GL_BLEND);
+  glBlendFunc(GL_ONE, GL_ONE);
+
+  glBindVertexArray(pData.vaoIds[currParticleID]);
+  glDrawArrays(GL_POINTS, 0, pData.num);
+  glBindVertexArray(gData.vaoId);
+
+  glDisable(GL_BLEND);
+  glDisable(GL_PROGRAM_POINT_SIZE);
+  glUseProgram(0);
+}
+
+void exportParticles( const char* filePath )
+{
+  // layout: int32 count, then count * float4 (xyz position in texture space, w age)
+  std::vector<GLfloat> particles(pData.num*4);
+  glBindBuffer(GL_ARRAY_BUFFER, pData.vboIds[currParticleID]);
+  glGetBufferSubData(GL_ARRAY_BUFFER, 0, particles.size()*sizeof(GLfloat), particles.data());
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+  std::ofstream fileStream(filePath, std::ios::out | std::ios::binary);
+  if(!fileStream.is_open()) {
+    std::cerr << "Could not write file " << filePath << "." << std::endl;
+    return;
+  }
+  int32_t num = pData.num;
+  fileStream.write((const char*)&num, sizeof(num));
+  fileStream.write((const char*)particles.data(), particles.size()*sizeof(GLfloat));
+  fileStream.close();
+  printf("exported %d particles to %s\n", pData.num, filePath);
+}
+
+void initReduction()
+{
+  static const GLfloat quads[] = {
+    -1.0f, -1.0f, 0.0f,
+    -1.0f, 1.0f, 0.0f,
+    1.0f, -1.0f, 0.0f,
+    -1.0f, 1.0f, 0.0f,
+    1.0f, -1.0f, 0.0f,
+    1.0f, 1.0f, 0.0f,
+   };
+
+  glGenVertexArrays(1, &rData.vaoId);
+  glBindVertexArray(rData.vaoId);
+  glGenBuffers(1, &rData.vboId);
+  glBindBuffer(GL_ARRAY_BUFFER, rData.vboId);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(quads), quads, GL_STATIC_DRAW);
+  glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+  glEnableVertexAttribArray(0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  glBindVertexArray(gData.vaoId);
+
+  glGenFramebuffers(1, &rData.fboId);
+
+  // level 0 folds REDUCE_BLOCK^3 blocks of the grid: one tile per REDUCE_BLOCK-deep slab,
+  // tiles laid out near-square. each next level folds REDUCE_BLOCK^2 texels, down to 1x1.
+  GLsizei slabs = (gridDesc.depth + REDUCE_BLOCK - 1)/REDUCE_BLOCK;
+  rData.slabTiles = GLsizei(std::ceil(std::sqrt(double(slabs))));
+  GLsizei w = (gridDesc.width + REDUCE_BLOCK - 1)/REDUCE_BLOCK * rData.slabTiles;
+  GLsizei h = (gridDesc.height + REDUCE_BLOCK - 1)/REDUCE_BLOCK * ((slabs + rData.slabTiles - 1)/rData.slabTiles);
+  for( ;; )
+  {
+    GLuint texId;
+    glGenTextures(1, &texId);
+    glBindTexture(GL_TEXTURE_2D, texId);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, w, h, 0, GL_RGBA, GL_FLOAT, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    rData.levelTexIds.push_back(texId);
+    rData.levelWidths.push_back(w);
+    rData.levelHeights.push_back(h);
+    if( w == 1 && h == 1 )
+      break;
+
+    w = (w + REDUCE_BLOCK - 1)/REDUCE_BLOCK;
+    h = (h + REDUCE_BLOCK - 1)/REDUCE_BLOCK;
+  }
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  glGenBuffers(READBACK_NUM, rData.pboIds);
+  for( int i = 0; i < READBACK_NUM; i++ )
+  {
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, rData.pboIds[i]);
+    glBufferData(GL_PIXEL_PACK_BUFFER, 4*sizeof(GLfloat), 0, GL_STREAM_READ);
+    rData.fences[i] = 0;
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  rData.readIdx = rData.writeIdx = rData.pending = 0;
+
+  rData.fieldsProgram = LoadShader("vertex.glsl", "frag_reduce_fields.glsl", nullptr);
+  rData.reduceProgram = LoadShader("vertex.glsl", "frag_reduce.glsl", nullptr);
+}
+
+void drawReduction( GLuint program, const simTexData& texData, int level )
+{
+  glBindFramebuffer(GL_FRAMEBUFFER, rData.fboId);
+  glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, rData.levelTexIds[level], 0);
+  GLenum attachment = GL_COLOR_ATTACHMENT0;
+  glDrawBuffers(1, &attachment);
+  glViewport(0, 0, rData.levelWidths[level], rData.levelHeights[level]);
+
+  glUseProgram( program );
+  setupUnifom( program, texData );
+
+  glBindVertexArray(rData.vaoId);
+  glDrawArrays(GL_TRIANGLES, 0, 6);
+  glBindVertexArray(gData.vaoId);
+
+  glUseProgram(0);
+}
+
+void applyReduction( const GLfloat* result )
+{
+  // out of core, the reduced grid is a preview standing in for the whole domain
+  const texDesc& domain = bData.enabled ? bData.domainDesc : gridDesc;
+  double cells = double(gridDesc.width)*gridDesc.height*gridDesc.depth;
+  double domainCells = double(domain.width)*domain.height*domain.depth;
+  rData.totalDensity = result[1]*domainCells/cells;
+  rData.residual = std::sqrt(result[2]/cells);
+
+  // out of core, the preview can miss velocity peaks: the timestep comes from the
+  // full-resolution bricks in haloTimestep() instead.
+  if( bData.enabled )
+  {
+    rData.maxVelocity = bData.maxVelocity;
+  }
+  else
+  {
+    // CFL: fastest cell moves CFL_TARGET cells per step along the finest axis
+    rData.maxVelocity = result[0];
+    GLsizei maxDim = std::max(domain.width, std::max(domain.height, domain.depth));
+    timestep = (rData.maxVelocity > 0.0f) ? CFL_TARGET/(rData.maxVelocity*maxDim) : TIMESTEP_MAX;
+    timestep = std::min(std::max(timestep, TIMESTEP_MIN), TIMESTEP_MAX);
+  }
+
+  // pressure converged: stop earlier next step, otherwise iterate longer
+  if( rData.residual > PRESSURE_TOLERANCE )
+    jacobiIters = std::min(jacobiIters+1, JACOBI_MAX_ITER);
+  else
+    jacobiIters = std::max(jacobiIters-1, JACOBI_MIN_ITER);
+}
+
+void collectReduction()
+{
+  // non-blocking: take whatever readbacks have landed, oldest first
+  while( rData.pending > 0 )
+  {
+    GLsync fence = rData.fences[rData.readIdx];
+    GLenum status = glClientWaitSync(fence, 0, 0);
+    if( status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED )
+      break;
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, rData.pboIds[rData.readIdx]);
+    GLfloat* result = (GLfloat*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, 4*sizeof(GLfloat), GL_MAP_READ_BIT);
+    if( result )
+    {
+      applyReduction( result );
+      glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
     }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    glDeleteSync(fence);
+    rData.fences[rData.readIdx] = 0;
+    rData.readIdx = (rData.readIdx+1) % READBACK_NUM;
+    rData.pending--;
+  }
+}
+
+void reduceFields( const simTexData& texData )
+{
+  collectReduction();
+  // all readbacks still in flight: skip this step rather than stall
+  if( rData.pending == READBACK_NUM )
+    return;
+
+  // 3D fields -> level 0
+  simTexData fieldsData = texData;
+  fieldsData.uniforms["slabTiles"] = rData.slabTiles;
+  bindInputTexture( fieldsData );
+  drawReduction( rData.fieldsProgram, fieldsData, 0 );
+
+  // level i-1 -> level i
+  simTexData levelData;
+  levelData.inputTexNames = { "partial" };
+  for( int i = 1; i < rData.levelTexIds.size(); i++ )
+  {
+    levelData.inputTexIds = { rData.levelTexIds[i-1] };
+    levelData.uniforms["srcWidth"] = rData.levelWidths[i-1];
+    levelData.uniforms["srcHeight"] = rData.levelHeights[i-1];
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, rData.levelTexIds[i-1]);
+    drawReduction( rData.reduceProgram, levelData, i );
+  }
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  // 1x1 result -> PBO, fenced; read back by a later step
+  glReadBuffer(GL_COLOR_ATTACHMENT0);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, rData.pboIds[rData.writeIdx]);
+  glReadPixels(0, 0, 1, 1, GL_RGBA, GL_FLOAT, 0);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  rData.fences[rData.writeIdx] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  rData.writeIdx = (rData.writeIdx+1) % READBACK_NUM;
+  rData.pending++;
+
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// false when the pool couldn't hold the step's textures; the state is then untouched.
+bool stepInCore( simTexData& texData )
+{
+  // the step's textures are acquired up front, all of them are live at once anyway
+  gData.velTexIds[resultVelID] = acquireTexture( gridDesc, GL_LINEAR );
+  gData.scalarTexIds[resultScalarID] = acquireTexture( gridDesc, GL_LINEAR );
+  gData.divTexId = acquireTexture( scalarFieldDesc(gridDesc), GL_NEAREST );
+  gData.presTexIds[resultPresID] = acquireTexture( scalarFieldDesc(gridDesc), GL_NEAREST );
+  if( !gData.velTexIds[resultVelID] || !gData.scalarTexIds[resultScalarID] ||
+      !gData.divTexId || !gData.presTexIds[resultPresID] )
+  {
+    releaseTexture( gData.velTexIds[resultVelID] );
+    releaseTexture( gData.scalarTexIds[resultScalarID] );
+    releaseTexture( gData.divTexId );
+    releaseTexture( gData.presTexIds[resultPresID] );
+    return false;
+  }
 
-    // 4. projection: 
-    // input: intermediate velocity & pressure
-    // output: final velocity
+  // 1. advect: 
+  // input: velocity, scalar
+  // output: intermediate velocity
+  texData.inputFboId = gData.fboId;
+  texData.inputTexIds = { gData.velTexIds[currVelID], gData.scalarTexIds[currScalarID] };
+  texData.inputTexNames = { "velocity", "scalar" };
+  texData.outputTexIds = { gData.velTexIds[resultVelID], gData.scalarTexIds[resultScalarID] };
+  texData.fragShader = "frag_pass1_advect.glsl";
+  drawToTexture( texData );
+
+  currScalarID = resultScalarID;
+  resultScalarID = (1-currScalarID);
+  releaseTexture( gData.scalarTexIds[resultScalarID] );
+
+  // apply force in advect pharse
+
+  // 2. divergence: 
+  // input: intermediate velocity
+  // output: intermediate divergence
+  texData.inputFboId = gData.fboId;
+  texData.inputTexIds = { gData.velTexIds[resultVelID]};
+  texData.inputTexNames = { "velocity" };
+  texData.outputTexIds = { gData.divTexId };
+  texData.fragShader = "frag_pass2_divergence.glsl";
+  drawToTexture( texData );
+
+  // can run jacobi iteration multiple times.
+  // the count follows the residual read back from earlier steps.
+  for( int i = 0; i < jacobiIters; i++ )
+  {
+    // 3. diffuse
+    // input: pressure & intermediate divergence
+    // output: updated pressure
     texData.inputFboId = gData.fboId;
-    texData.inputTexIds = { gData.velTexIds[resultVelID], gData.presTexIds[currPresID] };
-    texData.inputTexNames = { "velocity", "pressure" };
-    texData.outputTexIds = { gData.velTexIds[currVelID] };
-    texData.fragShader = "frag_pass4_proj.glsl";
+    texData.inputTexIds = { gData.presTexIds[currPresID], gData.divTexId };
+    texData.inputTexNames = { "pressure", "divergence" };
+    texData.outputTexIds = { gData.presTexIds[resultPresID] };
+    texData.uniforms["rAlpha"] = 1.0/timestep;
+    texData.uniforms["rBeta"] = 1.0f/(4+texData.uniforms["rAlpha"]);
+    texData.fragShader = "frag_pass3_diffuse.glsl";
     drawToTexture( texData );
 
+    currPresID = resultPresID;
+    resultPresID = (1-currPresID);
+  }
+
+  // 4. projection: 
+  // input: intermediate velocity & pressure
+  // output: final velocity
+  texData.inputFboId = gData.fboId;
+  texData.inputTexIds = { gData.velTexIds[resultVelID], gData.presTexIds[currPresID] };
+  texData.inputTexNames = { "velocity", "pressure" };
+  texData.outputTexIds = { gData.velTexIds[currVelID] };
+  texData.fragShader = "frag_pass4_proj.glsl";
+  drawToTexture( texData );
+  return true;
+}
+
+void simulate()
+{
+  simTexData texData;
+  texData.uniforms["texWidth"] = gridDesc.width;
+  texData.uniforms["texHeight"] = gridDesc.height;
+  texData.uniforms["texDepth"] = gridDesc.depth;
+  texData.uniforms["amtT"] = 300.0;
+  texData.uniforms["buoyAlpha"] = 0.34;
+  texData.uniforms["buoyBeta"] = 1.3;
+  texData.inputFboId = gData.fboId;
+  texData.vecUniforms["brickOffset"] = glm::vec3(0.0);
+  if( bData.enabled )
+    texData.vecUniforms["domainSize"] = glm::vec3(bData.domainDesc.width, bData.domainDesc.height, bData.domainDesc.depth);
+  else
+    texData.vecUniforms["domainSize"] = glm::vec3(gridDesc.width, gridDesc.height, gridDesc.depth);
+  
+  {
+    texData.uniforms["currTime"] = timestep;
+    //std::chrono::duration_cast<std::chrono::seconds>(deltaT).count();
+
+    // 1.-4. streamed brick by brick through host memory out of core
+    bool stepped = bData.enabled ? stepBricks( texData ) : stepInCore( texData );
+    if( !stepped )
+    {
+      releaseTexture( gData.presTexIds[resultPresID] );
+      return;
+    }
+    force_point = glm::vec3(0.0);
+
+    // 5. reduce:
+    // input: final velocity, scalar, pressure & previous jacobi iterate
+    // output: max |velocity|, total density, pressure residual, read back asynchronously
+    texData.inputTexIds = { gData.velTexIds[currVelID], gData.scalarTexIds[currScalarID],
+                            gData.presTexIds[currPresID], gData.presTexIds[resultPresID] };
+    texData.inputTexNames = { "velocity", "scalar", "pressure", "pressurePrev" };
+    reduceFields( texData );
+
+    releaseTexture( gData.presTexIds[resultPresID] );
+    releaseTexture( gData.divTexId );
+    releaseTexture( gData.velTexIds[resultVelID] );
+
+    // 6. particles: 
+    // input: final velocity
+    // output: advected particles
+    texData.inputTexIds = { gData.velTexIds[currVelID] };
+    texData.inputTexNames = { "velocity" };
+    texData.uniforms["lifetime"] = PARTICLE_LIFETIME;
+    texData.uniforms["emitterRadius"] = 0.05;
+    texData.uniforms["frameSeed"] = pData.steps;
+    texData.uniforms["reset"] = (pData.steps == 0) ? 1.0 : 0.0;
+    updateParticles( texData );
+
     // ray march to draw 3D texture
     texData.inputTexIds = { gData.scalarTexIds[currScalarID] };
     texData.inputTexNames = { "scalarCube" };
@@ -653,10 +1790,12 @@ void simulate()
     //texData.fragShader = "frag_ray_marching.glsl";
     texData.uniforms["absorption"] = 0.4;
     drawToScreen( texData );
-    
-    // swap texture
-    currPresID = resultPresID;
-    resultPresID = (1-currPresID);
+
+    texData.uniforms["pointSize"] = 2.0;
+    texData.uniforms["particleAlpha"] = 0.05;
+    drawParticles( texData );
+
+    glutSwapBuffers();
   }
 
   /*glDeleteTextures(BUF_NUM, velTexIds);
@@ -665,7 +1804,17 @@ void simulate()
   glDeleteFramebuffers(1, &fboId);
   glDeleteVertexArrays(1, &vaoId);*/
 
-  count += 0.001f;
+  count += timestep;
+
+  // frame-to-frame time, the interactive rate actually seen
+  static auto lastFrameT = std::chrono::system_clock::now();
+  auto nowT = std::chrono::system_clock::now();
+  double frameMs = std::chrono::duration<double, std::milli>(nowT - lastFrameT).count();
+  lastFrameT = nowT;
+  printf("frame: %.2f ms, particles: %d, textures in use: %lu bytes, peak %lu bytes, resident: %lu bytes, peak %lu bytes\n",
+         frameMs, pData.num, gPool.liveBytes, gPool.peakLiveBytes, gPool.currentBytes, gPool.peakBytes);
+  printf("timestep: %f, jacobi: %d, max velocity: %f, density: %f, residual: %f\n",
+         timestep, jacobiIters, rData.maxVelocity, rData.totalDensity, rData.residual);
 }
 
 void idle(void)
@@ -691,6 +1840,14 @@ void reshape( int screen_width, int screen_height )
     glViewport(0, 0, screen_width, screen_height);
 }
 
+void keyboard( unsigned char key, int x, int y )
+{
+    if( key == 'p' )
+    {
+      exportParticles("particles.bin");
+    }
+}
+
 void click( int button, int state, int x, int y )
 {
     if( button == GLUT_LEFT_BUTTON && state == GLUT_DOWN )
@@ -709,6 +1866,36 @@ void click( int button, int state, int x, int y )
 int main(int argc, char** argv)
 {
    glutInit(&argc, argv);
+   pData.num = (argc > 1) ? atoi(argv[1]) : PARTICLE_NUM;
+   if( pData.num <= 0 )
+   {
+      printf("invalid particle count: %s, using %d\n", argv[1], PARTICLE_NUM);
+      pData.num = PARTICLE_NUM;
+   }
+   int budgetMB = (argc > 2) ? atoi(argv[2]) : TEX_POOL_BUDGET_MB;
+   if( budgetMB <= 0 )
+   {
+      printf("invalid texture budget: %s MB, using %d MB\n", argv[2], TEX_POOL_BUDGET_MB);
+      budgetMB = TEX_POOL_BUDGET_MB;
+   }
+   gPool.budgetBytes = size_t(budgetMB) * 1024 * 1024;
+   // domain as WxHxD; beyond the budget or GL_MAX_3D_TEXTURE_SIZE it runs out of core,
+   // with fields memory-mapped under the swap directory when one is given.
+   if( argc > 3 )
+   {
+      GLsizei w, h, d;
+      if( sscanf(argv[3], "%dx%dx%d", &w, &h, &d) == 3 && w > 0 && h > 0 && d > 0 )
+      {
+         gridDesc.width = w;
+         gridDesc.height = h;
+         gridDesc.depth = d;
+      }
+      else
+      {
+         printf("invalid domain: %s, using %dx%dx%d\n", argv[3], TEX_WIDTH, TEX_HEIGHT, TEX_DEPTH);
+      }
+   }
+   if( argc > 4 ) bData.swapDir = argv[4];
    glutInitDisplayMode(GLUT_3_2_CORE_PROFILE | GLUT_DOUBLE | GLUT_RGBA);
    glutInitWindowSize(viewport[0],viewport[1]);
    glutInitWindowPosition((glutGet(GLUT_SCREEN_WIDTH)-viewport[0])/2,
@@ -733,11 +1920,14 @@ int main(int argc, char** argv)
    printf("max output vertices number : %d\n", value);
 
    initialize();
+   initReduction();
+   initParticles();
    glutDisplayFunc(simulate);
    glutIdleFunc(idle);
    glutTimerFunc( 10, timer, 0);
    glutReshapeFunc( reshape );
    glutMouseFunc( click );
+   glutKeyboardFunc( keyboard );
    //glutPostRedisplay();
 
    glutMainLoop();
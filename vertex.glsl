@@ -3,9 +3,11 @@ layout(location = 0) in vec3 in_Position;
 layout(location = 2) in vec2 in_UV;
 
 out vec2 vtx_UV;
+flat out int vtx_Instance;
 
 void main()
 {
 	gl_Position = vec4(in_Position, 1.0);
 	vtx_UV = in_UV;
-}
\ No newline at end of file
+	vtx_Instance = gl_InstanceID;
+}
@@ -0,0 +1,24 @@
+#version 330 core
+layout(location = 0) in vec4 in_Particle; // xyz: position in texture space, w: age in steps
+
+out float vtx_Alpha;
+
+uniform mat4 MVP;
+uniform float lifetime;
+uniform float pointSize;
+
+void main()
+{
+	// not emitted yet: push outside the clip volume
+	if( in_Particle.w < 0.0 )
+	{
+		gl_Position = vec4( 2.0, 2.0, 2.0, 1.0 );
+		gl_PointSize = 0.0;
+		vtx_Alpha = 0.0;
+		return;
+	}
+	// texture space [0,1] -> cube [-1,1]
+	gl_Position = MVP * vec4( in_Particle.xyz*2.0-1.0, 1.0 );
+	gl_PointSize = pointSize;
+	vtx_Alpha = 1.0 - in_Particle.w/lifetime;
+}
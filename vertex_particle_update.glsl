@@ -0,0 +1,76 @@
+#version 330 core
+layout(location = 0) in vec4 in_Particle; // xyz: position in texture space, w: age in steps
+
+out vec4 out_Particle;
+
+uniform float currTime;
+uniform float lifetime;
+uniform float emitterRadius;
+uniform float frameSeed;
+uniform float reset;
+uniform vec3 emitterPos;
+
+uniform sampler3D velocity;
+
+uint hash( in uint x )
+{
+   x ^= x >> 16;
+   x *= 0x7feb352du;
+   x ^= x >> 15;
+   x *= 0x846ca68bu;
+   x ^= x >> 16;
+   return x;
+}
+
+float random( in uint seed )
+{
+   return float(hash(seed)) / 4294967295.0;
+}
+
+vec3 emitPosition( in uint id )
+{
+   // uniform point in a sphere around the emitter
+   uint seed = hash( id ^ hash(uint(frameSeed)) );
+   float cosTheta = 2.0*random(seed) - 1.0;
+   float phi = 6.2831853*random(seed+1u);
+   float r = emitterRadius*pow( random(seed+2u), 1.0/3.0 );
+   float sinTheta = sqrt( 1.0 - cosTheta*cosTheta );
+   return emitterPos + r*vec3( sinTheta*cos(phi), cosTheta, sinTheta*sin(phi) );
+}
+
+bool isOutOfBox( in vec3 pos )
+{
+   return ( any( lessThan( pos, vec3(0.0) ) ) ||
+            any( greaterThan( pos, vec3(1.0) ) ) );
+}
+
+void main()
+{
+   uint id = uint(gl_VertexID);
+
+   // stagger birth over one lifetime so emission is continuous
+   if( reset > 0.5 )
+   {
+      out_Particle = vec4( emitterPos, -lifetime*random(id) );
+      return;
+   }
+
+   vec3 pos = in_Particle.xyz;
+   float age = in_Particle.w + 1.0;
+
+   // same explicit step as the grid advection: texcoord += dt * velocity
+   if( in_Particle.w >= 0.0 )
+   {
+      pos += currTime*texture( velocity, pos ).xyz;
+   }
+
+   bool born = ( in_Particle.w < 0.0 && age >= 0.0 );
+   bool expired = ( age >= lifetime || isOutOfBox(pos) );
+   if( born || expired )
+   {
+      pos = emitPosition(id);
+      age = 0.0;
+   }
+
+   out_Particle = vec4( pos, age );
+}